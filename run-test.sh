@@ -82,6 +82,9 @@ run_test "2.1" "./fatrec32 disks/sample.disk -i"
 # Test 2.2: List entries
 run_test "2.2" "./fatrec32 disks/sample.disk -l"
 
+# Test 2.7: Info and list in one run (disk is opened and mapped once)
+run_test "2.7" "./fatrec32 disks/sample.disk -i -l"
+
 # Test 2.3: Recover FILE1.TXT from fat32 single_recovery.dis
 # Create a temp copy of the disk to run tests in docker
 cp disks/single_recovery.disk disks/test_run.disk
@@ -133,3 +136,255 @@ run_test "4.3" "./fatrec32 disks/test_run_all.disk -l"
 
 # Clean up
 rm disks/test_run_all.disk
+
+# --- Large volume tests (sparse images built by tools/mkfat32) ---
+
+# Test 5.1: Build a sparse ~2 TB image with a deleted file past the 2 GiB mark
+run_test "5.1" "./tools/mkfat32 -c 64 disks/test_run_large.disk 2047G '~NEAR2G.TXT:30000@65500' 'LIVE.TXT:5@65000' 'HIGH.TXT:40000@100000' '~TAIL.TXT:70000@end-2'"
+
+# Test 5.2: Recover the file past the 2 GiB mark with SHA1 validation
+run_test "5.2" "./fatrec32 disks/test_run_large.disk -r NEAR2G.TXT -s 17cbc19e7172ecce8d88220e6da581ffd7a7b289"
+
+# Test 5.3: List the large image after recovery
+run_test "5.3" "./fatrec32 disks/test_run_large.disk -l"
+
+# Test 5.4: Recover a multi-cluster file at the end of the volume (start cluster needs DIR_FstClusHI)
+run_test "5.4" "./fatrec32 disks/test_run_large.disk -r TAIL.TXT -s b4e34cc6465298fe44fe0049ecfdf74c2080a2a5"
+
+# Test 5.5: List the large image to verify TAIL.TXT and its full 28-bit starting cluster
+run_test "5.5" "./fatrec32 disks/test_run_large.disk -l"
+
+# Clean up
+rm disks/test_run_large.disk
+
+# --- Batch recovery tests ---
+
+# Test 6.1: Build an image with three deleted files
+run_test "6.1" "./tools/mkfat32 disks/test_run_batch.disk 64M '~ALPHA.TXT:3000@10' '~BETA.TXT:5000@20' '~GAMMA.TXT:100@40' 'LIVE.TXT:10@50'"
+
+# Test 6.2: Recover from a manifest (good hash, wrong hash, no hash, missing file, bad line)
+run_test "6.2" "./fatrec32 disks/test_run_batch.disk -batch testfiles/batch.csv"
+
+# Test 6.3: List the image to verify ALPHA.TXT and GAMMA.TXT are back and BETA.TXT is not
+run_test "6.3" "./fatrec32 disks/test_run_batch.disk -l"
+
+# Clean up
+rm disks/test_run_batch.disk
+
+# --- Non-contiguous recovery tests ---
+
+# Test 7.1: Build an image with a deleted 10-cluster file scattered over clusters 3-12
+run_test "7.1" "./tools/mkfat32 -b 512 -c 1 disks/test_run_frag.disk 64M '~FRAG.TXT:5000@7,12,11,10,9,8,6,5,4,3'"
+
+# Test 7.2: Recover it by searching the orders of its clusters
+run_test "7.2" "./fatrec32 disks/test_run_frag.disk -R FRAG.TXT -s 9d2cb3cf2205429780e71950522a36d899efd99f"
+
+# Test 7.3: List the image to verify FRAG.TXT is back
+run_test "7.3" "./fatrec32 disks/test_run_frag.disk -l"
+
+# Clean up
+rm disks/test_run_frag.disk
+
+# Test 7.4: Build an 8 GB image with a deleted 391-cluster file in three fragments around live files
+run_test "7.4" "./tools/mkfat32 -c 8 disks/test_run_frag.disk 8G '~BIG.BIN:1600000@100000+150,100300+100,99000' 'LIVE1.BIN:204800@100150' 'LIVE2.BIN:409600@100200' 'LIVE3.BIN:40960@98990' 'LIVE4.BIN:4096@100400'"
+
+# Test 7.5: Reassemble it from the free clusters of the whole volume
+run_test "7.5" "./fatrec32 disks/test_run_frag.disk -R BIG.BIN -s 0cd7172defd5cd3c1dbd2d27d2394aac40ebdf6b"
+
+# Test 7.6: List the image to verify BIG.BIN is back
+run_test "7.6" "./fatrec32 disks/test_run_frag.disk -l"
+
+# Clean up
+rm disks/test_run_frag.disk
+
+# --- Extraction tests ---
+
+# Test 8.1: Build an image with a fragmented and two contiguous deleted files
+run_test "8.1" "./tools/mkfat32 -b 512 -c 1 disks/test_run_extract.disk 64M '~FRAG.TXT:5000@7,12,11,10,9,8,6,5,4,3' '~ALPHA.TXT:3000@20' '~GAMMA.TXT:700@30' 'LIVE.TXT:10@40'"
+
+# Test 8.2: Extract them to a directory with -r, -R and -all
+run_test "8.2" "./fatrec32 disks/test_run_extract.disk -o testfiles/output/extract -r ALPHA.TXT -R FRAG.TXT -s 9d2cb3cf2205429780e71950522a36d899efd99f -all"
+
+# Test 8.3: Verify the extracted contents
+run_test "8.3" "(cd testfiles/output/extract && shasum *)"
+
+# Test 8.4: Verify the image was not modified
+run_test "8.4" "shasum disks/test_run_extract.disk"
+
+# Test 8.5: Verify -r -s hashes the same when reading with pread()
+run_test "8.5" "./fatrec32 disks/test_run_extract.disk -io pread -o testfiles/output/extract -r ALPHA.TXT -s 9642de95e6441d6afd16cbc3935c495d0cda4678"
+
+# Clean up
+rm disks/test_run_extract.disk
+
+# --- Carving tests ---
+
+# Test 9.1: Build an image with files whose entries are gone, one of them partly overwritten by LIVE2.TXT
+run_test "9.1" "./tools/mkfat32 disks/test_run_carve.disk 64M '!PIC.PNG:3000@10' '!DOC.PDF:5000@30' '!ARCH.ZIP:2000@50' '~OLD.JPG:1500@70' 'LIVE.JPG:1200@80' '!ANIM.GIF:2000@90' '!CUT.PNG:3000@100' 'LIVE2.TXT:10@103' '!TAIL.PNG:1000@end-1'"
+
+# Test 9.2: Carve them out of the free clusters
+run_test "9.2" "./fatrec32 disks/test_run_carve.disk -o testfiles/output/carve -carve"
+
+# Test 9.3: Verify the carved contents
+run_test "9.3" "(cd testfiles/output/carve && shasum *)"
+
+# Clean up
+rm disks/test_run_carve.disk
+
+# Test 9.4: Build an image where a file crosses the boundary of the first 64 MB carving chunk
+run_test "9.4" "./tools/mkfat32 disks/test_run_carve.disk 256M '!PIC.PNG:3000@10' '!CROSS.PDF:200000@131000' '!NEXT.JPG:5000@131500' '!LATE.ZIP:9000@400000'"
+
+# Test 9.5: Carve it with several threads
+run_test "9.5" "./fatrec32 disks/test_run_carve.disk -j 4 -carve"
+
+# Test 9.6: Carve it again, streaming the clusters with pread() instead of the mapping
+run_test "9.6" "./fatrec32 disks/test_run_carve.disk -io pread -j 4 -carve"
+
+# Clean up
+rm disks/test_run_carve.disk
+
+# --- Long file name tests ---
+
+# Test 10.1: Build an image with deleted files that have long names, one spanning four slots
+run_test "10.1" "./tools/mkfat32 -c 8 disks/test_run_lfn.disk 64M '~LONGFI~1.TXT=Long file name.txt:3000@10' 'LIVE.TXT=live one.txt:10@20' '~VERYLO~1.DAT=A very long name that spans several slots.dat:5000@30' '~SHORT.TXT:100@40'"
+
+# Test 10.2: Recover by long name, ignoring case, and by 8.3 name
+run_test "10.2" "./fatrec32 disks/test_run_lfn.disk -r 'long FILE name.txt' -r 'A very long name that spans several slots.dat' -s af6dc9c193aa456758d5ed7247f48750fcbf24dc -r SHORT.TXT"
+
+# Test 10.3: Verify the entries and their long-name slots were restored
+run_test "10.3" "./fatrec32 disks/test_run_lfn.disk -l && shasum disks/test_run_lfn.disk"
+
+# Test 10.4: Extract by long name; the output keeps it
+run_test "10.4" "./tools/mkfat32 -c 8 disks/test_run_lfn.disk 64M '~LONGFI~1.TXT=Long file name.txt:3000@10' && ./fatrec32 disks/test_run_lfn.disk -o testfiles/output/lfn -ra 'LONG FILE NAME.TXT' && (cd testfiles/output/lfn && shasum *)"
+
+# Test 10.5: Match lower-case 8.3 names and wildcard patterns
+run_test "10.5" "./tools/mkfat32 -c 8 disks/test_run_lfn.disk 64M '~SHORT.TXT:100@10' '~PIC1.JPG:2000@20' '~PIC2.JPG=Holiday photo.jpg:3000@30' '~NOTE.TXT:50@40' && ./fatrec32 disks/test_run_lfn.disk -r short.txt -ra '*.JPG' -r 'N?T*.TXT' -l"
+
+# Test 10.6: A 20-slot long name of 3-byte UTF-8 characters (780 bytes) and one outside the BMP;
+# the extracted name is cut to 255 bytes, then both are restored in place by long name
+run_test "10.6" "./tools/mkfat32 -c 8 disks/test_run_lfn.disk 64M \"~WIDE~1.TXT=\$(printf '中%.0s' {1..260}):3000@10\" '~SMILE~1.TXT=Smile 😀.txt:100@20' && ./fatrec32 disks/test_run_lfn.disk -o testfiles/output/lfn2 -ra '*' && (cd testfiles/output/lfn2 && shasum * && ls | awk '{ print length(\$0) }') && ./fatrec32 disks/test_run_lfn.disk -r \"\$(printf '中%.0s' {1..260})\" -r 'smile 😀.TXT' -l"
+
+# Clean up
+rm disks/test_run_lfn.disk
+
+# --- Selector tests ---
+
+# Test 11.1: Build an image with deleted files of several types and sizes
+run_test "11.1" "./tools/mkfat32 -c 8 disks/test_run_select.disk 64M '~A.JPG:200000@10' '~B.JPG:1000@100' '~C.PNG:300000@200' '~D.TXT:50@400' '~E.GIF=Small picture.gif:900@410'"
+
+# Test 11.2: Recover the large pictures only
+run_test "11.2" "./fatrec32 disks/test_run_select.disk -all -where 'ext=JPG,PNG,GIF and size>=100K' -l"
+
+# Test 11.3: Combine -ra with a selector, -where given first
+run_test "11.3" "./fatrec32 disks/test_run_select.disk -where '(size<1K or name=small*) and mtime=2025-01' -ra '*' -l"
+
+# Test 11.4: Nothing was written in 2024
+run_test "11.4" "./fatrec32 disks/test_run_select.disk -all -where 'mtime<=2024 or ctime=2024-06..2024-12'"
+
+# Test 11.5: Reject a malformed selector
+run_test "11.5" "./fatrec32 disks/test_run_select.disk -all -where 'size>=1X'"
+
+# Test 11.6: Sizes past 4 GB are rejected, including ones whose K/M/G scaling would wrap to 0
+run_test "11.6" "./fatrec32 disks/test_run_select.disk -all -where 'size>=17179869184G'; ./fatrec32 disks/test_run_select.disk -all -where 'size<4G'; ./fatrec32 disks/test_run_select.disk -all -where 'size>4194303K and size<=3G'"
+
+# Clean up
+rm disks/test_run_select.disk
+
+# --- Cluster conflict tests ---
+
+# Test 12.1: Build an image where two deleted files overlap and one runs into a live file
+run_test "12.1" "./tools/mkfat32 disks/test_run_conflict.disk 64M '~ALPHA.TXT:2048@10' '~BETA.TXT:1024@12' 'LIVE.TXT:512@31' '~GAMMA.TXT:1536@29' '~DELTA.TXT:600@50' '~EMPTY.TXT:0@60'"
+
+# Test 12.2: Recover all; the conflicting files are reported and left deleted
+run_test "12.2" "./fatrec32 disks/test_run_conflict.disk -all -l"
+
+# Test 12.3: -ra checks its matches the same way
+run_test "12.3" "./tools/mkfat32 disks/test_run_conflict.disk 64M '~ALPHA.TXT:2048@10' '~ALPHA.TXT:1024@12' '~ALPHA.TXT:600@50' > /dev/null && ./fatrec32 disks/test_run_conflict.disk -ra ALPHA.TXT -l"
+
+# Test 12.4: A deleted directory whose cluster another deleted file claims is left alone, and so is everything in it
+run_test "12.4" "./tools/mkfat32 disks/test_run_conflict.disk 8M '~BIG.TXT:3000@28' '~SUB/:0@30' '~SUB/A.TXT:1000@40' '~OK/:0@50' '~OK/C.TXT:700@52' && cp disks/test_run_conflict.disk disks/test_run_conflict_pre.disk && ./fatrec32 disks/test_run_conflict.disk -all -l"
+
+# Test 12.5: With -where, the first clusters of the deleted directories restoreParents() relinks are claimed too
+run_test "12.5" "cp disks/test_run_conflict_pre.disk disks/test_run_conflict.disk && ./fatrec32 disks/test_run_conflict.disk -all -where 'size>=700' -l"
+
+# Test 12.6: The same for -ra
+run_test "12.6" "cp disks/test_run_conflict_pre.disk disks/test_run_conflict.disk && ./fatrec32 disks/test_run_conflict.disk -ra '*.TXT' -l"
+
+# Clean up
+rm disks/test_run_conflict.disk disks/test_run_conflict_pre.disk
+
+# --- Commit journal tests ---
+
+# Test 13.1: Build an image and keep a copy of it before any recovery
+run_test "13.1" "./tools/mkfat32 disks/test_run_journal.disk 8M '~HELLO.TXT:3000@10' 'KEEP.TXT:100@20' && cp disks/test_run_journal.disk disks/test_run_journal_pre.disk"
+
+# Test 13.2: A committed recovery leaves no undo log behind
+run_test "13.2" "./fatrec32 disks/test_run_journal.disk -r HELLO.TXT -l && test ! -e disks/test_run_journal.disk.fatrec32-undo && echo 'no undo log left'"
+
+# Test 13.3: An undo log left by an interrupted commit is only reported by a read-only run, then rolled back by a recovery run
+run_test "13.3" "{ printf 'FR32UNDO\001\0\0\0\0\0\0\0'; printf '\0\0\0\0\0\0\0\0\0\0\020\0'; head -c 1048576 disks/test_run_journal_pre.disk; printf 'FR32DONE'; } > disks/test_run_journal.disk.fatrec32-undo && ./fatrec32 disks/test_run_journal.disk -l && ./fatrec32 disks/test_run_journal.disk -o testfiles/output/journal -ra KEEP.TXT > /dev/null && ! cmp -s disks/test_run_journal.disk disks/test_run_journal_pre.disk && echo 'image untouched' && ./fatrec32 disks/test_run_journal.disk -r NONE.TXT -l && cmp disks/test_run_journal.disk disks/test_run_journal_pre.disk && echo 'image restored'"
+
+# Test 13.4: A log cut short before its end marker is discarded
+run_test "13.4" "printf 'FR32UNDO' > disks/test_run_journal.disk.fatrec32-undo && ./fatrec32 disks/test_run_journal.disk -r HELLO.TXT && test ! -e disks/test_run_journal.disk.fatrec32-undo && echo 'no undo log left'"
+
+# Test 13.5: With -undo-dir the log is kept (and rolled back from) there instead of next to the image
+run_test "13.5" "mkdir -p testfiles/output/undo && { printf 'FR32UNDO\001\0\0\0\0\0\0\0'; printf '\0\0\0\0\0\0\0\0\0\0\020\0'; head -c 1048576 disks/test_run_journal_pre.disk; printf 'FR32DONE'; } > testfiles/output/undo/test_run_journal.disk.fatrec32-undo && ./fatrec32 disks/test_run_journal.disk -undo-dir testfiles/output/undo -r NONE.TXT && cmp disks/test_run_journal.disk disks/test_run_journal_pre.disk && ls testfiles/output/undo && echo 'image restored'"
+
+# Test 13.6: Recovering in place on something other than a regular file needs -undo-dir
+run_test "13.6" "./fatrec32 /dev/null -r HELLO.TXT"
+
+# Clean up
+rm disks/test_run_journal.disk disks/test_run_journal_pre.disk
+
+# --- FAT copy tests ---
+
+# Test 14.1: Build an image with mirroring off and FAT 1 active; FAT 0 holds no file chains
+run_test "14.1" "./tools/mkfat32 -a 1 disks/test_run_fats.disk 8M '~A.TXT:3000@20' 'B.TXT:2000@20+4' '~C.TXT:1500@40' && cp disks/test_run_fats.disk disks/test_run_fats_pre.disk"
+
+# Test 14.2: Chains are read from the active FAT (A.TXT overlaps B.TXT) and FAT 0 is left alone
+run_test "14.2" "./fatrec32 disks/test_run_fats.disk -all -l && cmp -n 81920 disks/test_run_fats.disk disks/test_run_fats_pre.disk && echo 'FAT 0 untouched'"
+
+# Test 14.3: With mirroring on, every one of three FAT copies is updated
+run_test "14.3" "./tools/mkfat32 -f 3 disks/test_run_fats.disk 8M '~A.TXT:3000@20' 'B.TXT:100@30' > /dev/null && ./fatrec32 disks/test_run_fats.disk -r A.TXT && cmp -i 16384:81920 -n 65536 disks/test_run_fats.disk disks/test_run_fats.disk && cmp -i 16384:147456 -n 65536 disks/test_run_fats.disk disks/test_run_fats.disk && echo 'FAT copies match'"
+
+# Test 14.4: A volume with a single FAT
+run_test "14.4" "./tools/mkfat32 -f 1 disks/test_run_fats.disk 8M '~A.TXT:3000@20' > /dev/null && ./fatrec32 disks/test_run_fats.disk -r A.TXT -l"
+
+# Clean up
+rm disks/test_run_fats.disk disks/test_run_fats_pre.disk
+
+# --- Chain extent tests ---
+
+# Test 15.1: Build an image with a deleted file several read windows long
+run_test "15.1" "./tools/mkfat32 disks/test_run_chain.disk 64M '~BIG.TXT:3000000@100' '~SMALL.TXT:700@50' 'LIVE.TXT:100@60'"
+
+# Test 15.2: Hash it through pread() windows, then with the chain cached; a wrong hash first leaves it deleted
+run_test "15.2" "./fatrec32 disks/test_run_chain.disk -io pread -r BIG.TXT -s 0000000000000000000000000000000000000000 -r BIG.TXT -s 0a793ecb7a52e9b95916d27024e5f858608d4776 -r SMALL.TXT -s e6e1afe87844989deaa31b8ab4d93968def9e5b3 -l"
+
+# Clean up
+rm disks/test_run_chain.disk
+
+# --- Statistics tests ---
+
+# Test 16.1: Build an image with two deleted files and a live one
+run_test "16.1" "./tools/mkfat32 disks/test_run_stats.disk 8M '~A.TXT:3000@20' '~B.TXT:5000@30' 'C.TXT:100@40'"
+
+# Test 16.2: The text report lists every phase and the counters of the run
+run_test "16.2" "./fatrec32 disks/test_run_stats.disk -r A.TXT -s 0000000000000000000000000000000000000000 -stats 2>&1 >/dev/null | grep -E '^(mapping|directory scan|hash verification|permutation search|carving|FAT commit) |^(Directory|Deleted|SHA-1|Permutations|FAT entries)' | sed 's/  .*//'"
+
+# Test 16.3: The JSON report counts the FAT entries the recovery writes
+run_test "16.3" "./fatrec32 disks/test_run_stats.disk -all -stats json 2>&1 >/dev/null | grep -oE '\"(dir_clusters_scanned|entries_decoded|deleted_candidates|fat_entries_written)\": [0-9]+'"
+
+# Clean up
+rm disks/test_run_stats.disk
+
+# --- Directory attribute tests ---
+
+# Test 17.1: Hidden (0x12) and archive-bit (0x30) directories are walked like plain ones
+run_test "17.1" "./tools/mkfat32 disks/test_run_attr.disk 8M 'SUB/#12:0@10' 'SUB/INNER.TXT:100@20' '~OLD/#32:0@30' '~OLD/A.TXT:500@40' 'ARC/#30:0@50' && ./fatrec32 disks/test_run_attr.disk -l"
+
+# Test 17.2: A deleted hidden directory is restored as a directory; FAT[30] (byte 32 * 512 + 30 * 4) links its cluster
+run_test "17.2" "./fatrec32 disks/test_run_attr.disk -all -l && od -An -tx4 -j 16504 -N4 disks/test_run_attr.disk"
+
+# Clean up
+rm disks/test_run_attr.disk
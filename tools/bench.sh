@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# Measures fatrec32's throughput on a synthetic image built by tools/benchimg.
+#
+# usage: tools/bench.sh [benchimg options] [size]
+#   e.g. tools/bench.sh -n 100000 -d 64 -x 30 -g 20 4G
+#
+# Every operation runs BENCH_RUNS times (default 3) on a fresh copy of the
+# image and the fastest run is reported. Images live in BENCH_DIR (default
+# /tmp) and are removed afterwards. Run it through `make bench`, passing
+# options in BENCH, e.g. make bench BENCH="-n 50000 2G".
+
+cd "$(dirname "$0")/.." || exit 1
+
+dir=${BENCH_DIR:-/tmp}
+runs=${BENCH_RUNS:-3}
+img=$dir/fatrec32-bench.disk
+work=$dir/fatrec32-bench-work.disk
+info=$dir/fatrec32-bench.info
+
+# the volume size is the last argument
+if [ $# -eq 0 ]; then
+    set -- 1G
+fi
+
+cleanup() {
+    rm -f "$img" "$img.csv" "$work" "$work.fatrec32-undo" "$info"
+}
+trap cleanup EXIT
+
+echo "Building the image: tools/benchimg $*"
+if ! ./tools/benchimg "${@:1:$#-1}" "$img" "${@: -1}" > "$info"; then
+    exit 1
+fi
+
+get() {
+    awk -v key="$1" '$1 == key { print $2 }' "$info"
+}
+
+# time_op label command...: best wall time of the runs in $best, output of the last in $out
+time_op() {
+    best=""
+    for ((run = 0; run < runs; run++)); do
+        cp --sparse=always "$img" "$work"
+        local start=$(date +%s.%N)
+        out=$(./fatrec32 "$work" "$@" 2>&1)
+        local status=$?
+        local end=$(date +%s.%N)
+        if [ $status -ne 0 ]; then
+            echo "fatrec32 $* failed:"
+            echo "$out"
+            exit 1
+        fi
+        best=$(awk -v s="$start" -v e="$end" -v b="$best" 'BEGIN { t = e - s; if (b == "" || t < b) b = t; print b }')
+    done
+}
+
+# report label amount unit: prints the best time and amount per second
+report() {
+    awk -v label="$1" -v t="$best" -v n="$2" -v unit="$3" \
+        'BEGIN { rate = t > 0 ? n / t : 0; printf "%-28s %9.4f s %14.1f %s\n", label, t, rate, unit }'
+}
+
+mb() {
+    awk -v b="$1" 'BEGIN { print b / 1048576 }'
+}
+
+echo "$(get directories) directories, $(get entries) entries, $(get deleted) deleted" \
+     "($(mb "$(get deleted_bytes)") MB), $(get fragmented) fragmented, $(get cluster_size) B clusters"
+echo
+
+time_op -l
+report "-l" "$(echo "$out" | awk '/^Total number of entries/ { print $NF }')" "entries/s"
+
+time_op -r "$(get big_name)" -s "$(get big_sha1)"
+report "-r $(get big_name) -s" "$(mb "$(get big_bytes)")" "MB/s hashed"
+
+time_op -batch "$img.csv"
+report "-batch (deleted files)" "$(mb "$(get deleted_bytes)")" "MB/s hashed"
+
+# a hash nothing matches makes -R try every order; -t 0 skips the fragment search after it
+time_op -R "$(get perm_name)" -s 0000000000000000000000000000000000000000 -t 0
+report "-R $(get perm_name) (all orders)" "$(get perm_orders)" "perms/s"
+
+time_op -ra 'F*.BIN'
+report "-ra 'F*.BIN'" "$(echo "$out" | awk '/file\(s\) recovered$/ { print $2 }')" "files/s"
+
+time_op -all
+report "-all" "$(echo "$out" | awk '/^Successfully recovered/ { print $3 }')" "files/s"
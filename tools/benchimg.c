@@ -0,0 +1,591 @@
+/**
+ * FAT32 Benchmark Image Generator
+ *
+ * Builds a sparse FAT32 image with a whole directory tree for measuring
+ * fatrec32's throughput (see tools/bench.sh). The number of files, the
+ * directory fan-out, the share of deleted files, the share of fragmented
+ * files and the mean file size are configurable; the same options and seed
+ * always produce the same image.
+ *
+ * Besides the tree, the root holds two deleted files for single-file runs:
+ * BIG.BIN, one large contiguous file for -r -s, and PERM.BIN, a file of
+ * PERM_CLUSTERS clusters scattered over the clusters -R orders, for timing
+ * the permutation search. The deleted files of the tree are listed with
+ * their SHA-1 in <image>.csv for -batch, and a summary of the image is
+ * printed as "key value" lines.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+
+#define CLUSTER_EOC 0x0FFFFFFF   // end-of-chain marker written for live files
+#define MAX_CLUSTERS 0x0FFFFFF5  // largest cluster count of a FAT32 volume
+#define RESERVED_SECTORS 32
+#define PERM_CLUSTERS 10         // size of PERM.BIN; fatrec32 orders at most 10 clusters
+#define FIRST_FREE 22            // clusters below this are left to PERM.BIN: -R orders clusters below 20,
+                                 // and recovered contiguously from 12 it would take 12-21
+
+#pragma pack(push, 1)
+typedef struct BootEntry
+{
+  unsigned char BS_jmpBoot[3];
+  unsigned char BS_OEMName[8];
+  unsigned short BPB_BytsPerSec;
+  unsigned char BPB_SecPerClus;
+  unsigned short BPB_RsvdSecCnt;
+  unsigned char BPB_NumFATs;
+  unsigned short BPB_RootEntCnt;
+  unsigned short BPB_TotSec16;
+  unsigned char BPB_Media;
+  unsigned short BPB_FATSz16;
+  unsigned short BPB_SecPerTrk;
+  unsigned short BPB_NumHeads;
+  unsigned int BPB_HiddSec;
+  unsigned int BPB_TotSec32;
+  unsigned int BPB_FATSz32;
+  unsigned short BPB_ExtFlags;
+  unsigned short BPB_FSVer;
+  unsigned int BPB_RootClus;
+  unsigned short BPB_FSInfo;
+  unsigned short BPB_BkBootSec;
+  unsigned char BPB_Reserved[12];
+  unsigned char BS_DrvNum;
+  unsigned char BS_Reserved1;
+  unsigned char BS_BootSig;
+  unsigned int BS_VolID;
+  unsigned char BS_VolLab[11];
+  unsigned char BS_FilSysType[8];
+} BootEntry;
+
+typedef struct DirEntry
+{
+  unsigned char DIR_Name[11];
+  unsigned char DIR_Attr;
+  unsigned char DIR_NTRes;
+  unsigned char DIR_CrtTimeTenth;
+  unsigned short DIR_CrtTime;
+  unsigned short DIR_CrtDate;
+  unsigned short DIR_LstAccDate;
+  unsigned short DIR_FstClusHI;
+  unsigned short DIR_WrtTime;
+  unsigned short DIR_WrtDate;
+  unsigned short DIR_FstClusLO;
+  unsigned int DIR_FileSize;
+} DirEntry;
+#pragma pack(pop)
+
+/**
+ * Geometry of the image being generated and the shape of its tree.
+ */
+typedef struct Image {
+    int fd;
+    unsigned int bytesPerSec;
+    unsigned int secPerClus;
+    unsigned int totalSectors;
+    unsigned int fatSectors;
+    unsigned int clusterSize;
+    unsigned int clusterCount;
+    uint64_t dataStart;
+    unsigned int *fat;          // in-memory FAT, written to both copies at the end
+    unsigned int nextCluster;   // next cluster to allocate
+    uint64_t rng;               // xorshift state for sizes, deletions and gaps
+
+    unsigned int numFiles;      // files of the tree
+    unsigned int fanout;        // files and subdirectories per directory
+    unsigned int deletedPct;    // share of deleted files, in percent
+    unsigned int fragmentedPct; // share of live files split into 2-4 pieces, in percent
+    unsigned int meanSize;      // mean file size in bytes
+    unsigned int bigSize;       // size of BIG.BIN
+} Image;
+
+/**
+ * A directory of the tree.
+ */
+typedef struct BenchDir {
+    unsigned int parent;        // index of the parent directory (the root is its own)
+    unsigned int firstCluster;
+    char path[256];             // path from the root, "" for the root
+} BenchDir;
+
+/**
+ * Counters printed in the summary.
+ */
+typedef struct Summary {
+    unsigned int entries;       // file and directory entries, "." and ".." excluded
+    unsigned int deleted;       // deleted files of the tree
+    uint64_t deletedBytes;
+    unsigned int fragmented;    // live files split into pieces
+    uint64_t liveBytes;
+} Summary;
+
+/**
+ * Prints usage information to stderr.
+ */
+void errUse() {
+    fprintf(stderr, "Usage: benchimg [-c sectors-per-cluster] [-n files] [-d fanout] [-x deleted%%]\n");
+    fprintf(stderr, "                [-g fragmented%%] [-m mean-size] [-B big-size] [-s seed] image size\n");
+    fprintf(stderr, "  files       Files in the directory tree (default 10000).\n");
+    fprintf(stderr, "  fanout      Files and subdirectories per directory (default 32).\n");
+    fprintf(stderr, "  deleted%%    Share of the files that are deleted (default 25).\n");
+    fprintf(stderr, "  fragmented%% Share of the live files split into 2-4 pieces (default 10).\n");
+    fprintf(stderr, "  mean-size   Mean file size; sizes are spread evenly up to twice it (default 32K).\n");
+    fprintf(stderr, "  big-size    Size of the deleted BIG.BIN in the root (default 64M).\n");
+    fprintf(stderr, "  size        Volume size, with optional K, M, G or T suffix (e.g. 2G).\n");
+}
+
+/**
+ * Parses a byte count with an optional K/M/G/T binary suffix.
+ *
+ * @return The size in bytes, or 0 if the string is not a valid size
+ */
+uint64_t parseSize(const char *text) {
+    char *end;
+    uint64_t value = strtoull(text, &end, 10);
+
+    switch (toupper((unsigned char)*end)) {
+    case 'T': value <<= 10; // fall through
+    case 'G': value <<= 10; // fall through
+    case 'M': value <<= 10; // fall through
+    case 'K': value <<= 10; end++; break;
+    case '\0': break;
+    default: return 0;
+    }
+    return *end == '\0' ? value : 0;
+}
+
+/**
+ * Returns the next pseudo-random number of the image.
+ */
+uint64_t nextRandom(Image *img) {
+    img->rng ^= img->rng << 13;
+    img->rng ^= img->rng >> 7;
+    img->rng ^= img->rng << 17;
+    return img->rng;
+}
+
+/**
+ * Converts "NAME.EXT" into the 11-byte space padded directory form.
+ */
+void toShortName(const char *name, unsigned char *out) {
+    memset(out, ' ', 11);
+    const char *dot = strchr(name, '.');
+    size_t baseLen = dot ? (size_t)(dot - name) : strlen(name);
+
+    for (size_t i = 0; i < baseLen && i < 8; i++) {
+        out[i] = toupper((unsigned char)name[i]);
+    }
+    if (dot) {
+        for (size_t i = 0; dot[1 + i] != '\0' && i < 3; i++) {
+            out[8 + i] = toupper((unsigned char)dot[1 + i]);
+        }
+    }
+}
+
+/**
+ * Fills buffer with the deterministic contents of a file (xorshift seeded by
+ * the file name, as mkfat32 does).
+ */
+void fillContents(const char *name, unsigned char *buffer, size_t len) {
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (const char *p = name; *p; p++) {
+        state = (state ^ (unsigned char)*p) * 0x100000001B3ull;
+    }
+    for (size_t i = 0; i < len; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        buffer[i] = 0x20 + (state % 95);
+    }
+}
+
+/**
+ * Writes len bytes at offset, exiting on failure.
+ */
+void writeAt(Image *img, const void *buffer, size_t len, uint64_t offset) {
+    if (pwrite(img->fd, buffer, len, offset) != (ssize_t)len) {
+        perror("pwrite");
+        exit(1);
+    }
+}
+
+/**
+ * Returns the byte offset of a data cluster.
+ */
+uint64_t clusterOffset(Image *img, unsigned int cluster) {
+    return img->dataStart + (uint64_t)(cluster - 2) * img->clusterSize;
+}
+
+/**
+ * Computes FAT size and cluster count for the requested volume size, with
+ * two FATs.
+ *
+ * @return 1 on success, 0 if the geometry is not a valid FAT32 volume
+ */
+int layoutImage(Image *img, uint64_t volumeSize) {
+    uint64_t sectors = volumeSize / img->bytesPerSec;
+    if (sectors > 0xFFFFFFFFull) {
+        fprintf(stderr, "Volume too large for a 32-bit sector count\n");
+        return 0;
+    }
+    img->totalSectors = sectors;
+    img->clusterSize = img->bytesPerSec * img->secPerClus;
+
+    uint64_t clusters = (sectors - RESERVED_SECTORS) / img->secPerClus;
+    img->fatSectors = ((clusters + 2) * 4 + img->bytesPerSec - 1) / img->bytesPerSec;
+    if (sectors <= RESERVED_SECTORS + 2ull * img->fatSectors) return 0;
+
+    clusters = (sectors - RESERVED_SECTORS - 2ull * img->fatSectors) / img->secPerClus;
+    if (clusters < FIRST_FREE || clusters > MAX_CLUSTERS) return 0;
+    img->clusterCount = clusters;
+    img->dataStart = (uint64_t)(RESERVED_SECTORS + 2 * img->fatSectors) * img->bytesPerSec;
+    return 1;
+}
+
+/**
+ * Takes count consecutive clusters from the free space.
+ *
+ * @return The first of them
+ *
+ * Error handling:
+ * - Exits with status 1 if the volume is full
+ */
+unsigned int allocClusters(Image *img, unsigned int count) {
+    if ((uint64_t)img->nextCluster + count > (uint64_t)img->clusterCount + 2) {
+        fprintf(stderr, "Volume too small for the requested files\n");
+        exit(1);
+    }
+    unsigned int first = img->nextCluster;
+    img->nextCluster += count;
+    return first;
+}
+
+/**
+ * Links clusters into a chain in the FAT, ending it with CLUSTER_EOC.
+ */
+void linkChain(Image *img, const unsigned int *clusters, unsigned int count) {
+    for (unsigned int i = 0; i + 1 < count; i++) {
+        img->fat[clusters[i]] = clusters[i + 1];
+    }
+    img->fat[clusters[count - 1]] = CLUSTER_EOC;
+}
+
+/**
+ * Fills in a directory entry.
+ */
+void setEntry(DirEntry *entry, const char *name, unsigned char attr, unsigned int cluster, unsigned int size) {
+    memset(entry, 0, sizeof(*entry));
+    toShortName(name, entry->DIR_Name);
+    entry->DIR_Attr = attr;
+    entry->DIR_CrtDate = entry->DIR_WrtDate = (45 << 9) | (1 << 5) | 1;  // 2025-01-01
+    entry->DIR_FstClusHI = cluster >> 16;
+    entry->DIR_FstClusLO = cluster & 0xFFFF;
+    entry->DIR_FileSize = size;
+}
+
+/**
+ * Writes a file's contents into clusters, given in file order, and returns
+ * its SHA-1.
+ */
+void writeFile(Image *img, const char *name, unsigned int size, const unsigned int *clusters,
+               unsigned char *digest) {
+    unsigned char *contents = malloc(size ? size : 1);
+    if (!contents) {
+        fprintf(stderr, "Can't allocate %u bytes\n", size);
+        exit(1);
+    }
+    fillContents(name, contents, size);
+
+    // runs of adjacent clusters are written at once
+    unsigned int written = 0;
+    for (unsigned int i = 0; written < size; ) {
+        unsigned int run = 1;
+        while ((uint64_t)run * img->clusterSize < size - written && clusters[i + run] == clusters[i] + run) run++;
+        uint64_t len = (uint64_t)run * img->clusterSize;
+        if (len > size - written) len = size - written;
+        writeAt(img, contents + written, len, clusterOffset(img, clusters[i]));
+        written += len;
+        i += run;
+    }
+
+    EVP_Digest(contents, size, digest, NULL, EVP_sha1(), NULL);
+    free(contents);
+}
+
+/**
+ * Prints a SHA-1 digest in hex.
+ */
+void printDigest(FILE *out, const unsigned char *digest) {
+    for (int b = 0; b < 20; b++) fprintf(out, "%02x", digest[b]);
+}
+
+/**
+ * Places one file of the tree: picks its size and whether it is deleted or
+ * fragmented, allocates and writes its clusters and fills in its entry.
+ * Deleted files are contiguous and left out of the FAT, as a delete leaves
+ * them; fragmented live files leave small free gaps between their pieces.
+ */
+void placeFile(Image *img, BenchDir *dir, unsigned int number, DirEntry *entry, FILE *manifest, Summary *sum) {
+    char name[13];
+    char path[300];
+    snprintf(name, sizeof(name), "F%07u.BIN", number);
+    snprintf(path, sizeof(path), "%s%s%s", dir->path, dir->path[0] ? "/" : "", name);
+
+    unsigned int size = nextRandom(img) % (2ull * img->meanSize + 1);
+    int deleted = nextRandom(img) % 100 < img->deletedPct;
+    unsigned int numClusters = size == 0 ? 0 : (size - 1) / img->clusterSize + 1;
+    unsigned int *clusters = malloc((numClusters ? numClusters : 1) * sizeof(unsigned int));
+    unsigned char digest[20];
+
+    unsigned int pieces = 1;
+    if (!deleted && numClusters >= 2 && nextRandom(img) % 100 < img->fragmentedPct) {
+        pieces = 2 + nextRandom(img) % 3;
+        if (pieces > numClusters) pieces = numClusters;
+        sum->fragmented++;
+    }
+    for (unsigned int p = 0, placed = 0; p < pieces; p++) {
+        unsigned int len = p + 1 == pieces ? numClusters - placed : numClusters / pieces;
+        if (p > 0) allocClusters(img, 1 + nextRandom(img) % 8);   // free gap
+        unsigned int first = allocClusters(img, len);
+        for (unsigned int c = 0; c < len; c++) clusters[placed++] = first + c;
+    }
+
+    setEntry(entry, name, 0x20, numClusters ? clusters[0] : 0, size);
+    writeFile(img, path, size, clusters, digest);
+    if (deleted) {
+        entry->DIR_Name[0] = 0xE5;
+        fprintf(manifest, "%s,", path);
+        printDigest(manifest, digest);
+        fprintf(manifest, "\n");
+        sum->deleted++;
+        sum->deletedBytes += size;
+    } else {
+        if (numClusters > 0) linkChain(img, clusters, numClusters);
+        sum->liveBytes += size;
+    }
+    sum->entries++;
+    free(clusters);
+}
+
+/**
+ * Writes the root's deleted BIG.BIN and PERM.BIN and prints their summary
+ * lines. PERM.BIN starts at the last of its clusters; its other clusters are
+ * the lowest free ones, which -R takes as the clusters to order, stored in
+ * a scrambled order.
+ */
+void placeRootFiles(Image *img, DirEntry *entries) {
+    unsigned char digest[20];
+
+    unsigned int bigClusters = img->bigSize == 0 ? 0 : (img->bigSize - 1) / img->clusterSize + 1;
+    unsigned int *clusters = malloc((bigClusters ? bigClusters : 1) * sizeof(unsigned int));
+    unsigned int first = bigClusters ? allocClusters(img, bigClusters) : 0;
+    for (unsigned int c = 0; c < bigClusters; c++) clusters[c] = first + c;
+    setEntry(&entries[0], "BIG.BIN", 0x20, first, img->bigSize);
+    writeFile(img, "BIG.BIN", img->bigSize, clusters, digest);
+    entries[0].DIR_Name[0] = 0xE5;
+    free(clusters);
+    printf("big_name BIG.BIN\nbig_bytes %u\nbig_sha1 ", img->bigSize);
+    printDigest(stdout, digest);
+    printf("\n");
+
+    static const unsigned int order[PERM_CLUSTERS] = { 12, 7, 3, 10, 5, 11, 4, 9, 6, 8 };
+    unsigned int permSize = (PERM_CLUSTERS - 1) * img->clusterSize + img->clusterSize / 2;
+    setEntry(&entries[1], "PERM.BIN", 0x20, order[0], permSize);
+    writeFile(img, "PERM.BIN", permSize, order, digest);
+    entries[1].DIR_Name[0] = 0xE5;
+
+    uint64_t orders = 1;
+    for (unsigned int i = 2; i < PERM_CLUSTERS; i++) orders *= i;
+    printf("perm_name PERM.BIN\nperm_clusters %u\nperm_orders %llu\nperm_sha1 ", PERM_CLUSTERS,
+           (unsigned long long)orders);
+    printDigest(stdout, digest);
+    printf("\n");
+}
+
+/**
+ * Writes the boot sector (and its backup at sector 6).
+ */
+void writeBootSector(Image *img) {
+    unsigned char *sector = calloc(1, img->bytesPerSec);
+    BootEntry *boot = (BootEntry *)sector;
+
+    memcpy(boot->BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(boot->BS_OEMName, "BENCHIMG", 8);
+    boot->BPB_BytsPerSec = img->bytesPerSec;
+    boot->BPB_SecPerClus = img->secPerClus;
+    boot->BPB_RsvdSecCnt = RESERVED_SECTORS;
+    boot->BPB_NumFATs = 2;
+    boot->BPB_Media = 0xF8;
+    boot->BPB_SecPerTrk = 63;
+    boot->BPB_NumHeads = 255;
+    boot->BPB_TotSec32 = img->totalSectors;
+    boot->BPB_FATSz32 = img->fatSectors;
+    boot->BPB_RootClus = 2;
+    boot->BPB_FSInfo = 1;
+    boot->BPB_BkBootSec = 6;
+    boot->BS_DrvNum = 0x80;
+    boot->BS_BootSig = 0x29;
+    boot->BS_VolID = 0x42454E43;
+    memcpy(boot->BS_VolLab, "NO NAME    ", 11);
+    memcpy(boot->BS_FilSysType, "FAT32   ", 8);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    writeAt(img, sector, img->bytesPerSec, 0);
+    writeAt(img, sector, img->bytesPerSec, 6ull * img->bytesPerSec);
+    free(sector);
+}
+
+/**
+ * Writes both FAT copies, up to the last cluster in use.
+ */
+void writeFats(Image *img) {
+    uint64_t used = ((uint64_t)img->nextCluster * 4 + img->bytesPerSec - 1) / img->bytesPerSec * img->bytesPerSec;
+    for (unsigned int copy = 0; copy < 2; copy++) {
+        uint64_t base = (uint64_t)(RESERVED_SECTORS + copy * img->fatSectors) * img->bytesPerSec;
+        writeAt(img, img->fat, used, base);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Image img = {
+        .bytesPerSec = 512, .secPerClus = 8, .rng = 0x2545F4914F6CDD1Dull,
+        .numFiles = 10000, .fanout = 32, .deletedPct = 25, .fragmentedPct = 10,
+        .meanSize = 32 << 10, .bigSize = 64 << 20,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:d:x:g:m:B:s:")) != -1) {
+        switch (opt) {
+        case 'c': img.secPerClus = atoi(optarg); break;
+        case 'n': img.numFiles = atoi(optarg); break;
+        case 'd': img.fanout = atoi(optarg); break;
+        case 'x': img.deletedPct = atoi(optarg); break;
+        case 'g': img.fragmentedPct = atoi(optarg); break;
+        case 'm': img.meanSize = parseSize(optarg); break;
+        case 'B': img.bigSize = parseSize(optarg); break;
+        case 's': img.rng ^= strtoull(optarg, NULL, 10) * 0x9E3779B97F4A7C15ull; break;
+        default: errUse(); return 1;
+        }
+    }
+    if (argc - optind != 2 || img.fanout < 2 || img.fanout > 16384 || img.deletedPct > 100 ||
+        img.fragmentedPct > 100 || img.meanSize > (1u << 30) || img.rng == 0) {
+        errUse();
+        return 1;
+    }
+
+    if (!layoutImage(&img, parseSize(argv[optind + 1]))) {
+        fprintf(stderr, "Invalid FAT32 geometry for size %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    img.fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img.fd < 0 || ftruncate(img.fd, (uint64_t)img.totalSectors * img.bytesPerSec) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    char manifestPath[4096];
+    snprintf(manifestPath, sizeof(manifestPath), "%s.csv", argv[optind]);
+    FILE *manifest = fopen(manifestPath, "w");
+    if (!manifest) {
+        perror(manifestPath);
+        return 1;
+    }
+    fprintf(manifest, "name,sha1\n");
+
+    img.fat = calloc((uint64_t)img.fatSectors * img.bytesPerSec, 1);
+    if (!img.fat) {
+        fprintf(stderr, "Can't allocate FAT\n");
+        return 1;
+    }
+    img.fat[0] = 0x0FFFFFF8;
+    img.fat[1] = 0x0FFFFFFF;
+    img.nextCluster = FIRST_FREE;
+
+    // directory i > 0 is child (i - 1) % fanout of directory (i - 1) / fanout,
+    // and directory d holds files d * fanout and up
+    unsigned int numDirs = img.numFiles == 0 ? 1 : (img.numFiles - 1) / img.fanout + 1;
+    BenchDir *dirs = calloc(numDirs, sizeof(BenchDir));
+    Summary sum = { 0 };
+    unsigned int entriesPerCluster = img.clusterSize / sizeof(DirEntry);
+
+    for (unsigned int d = 0; d < numDirs; d++) {
+        BenchDir *dir = &dirs[d];
+        if (d > 0) {
+            dir->parent = (d - 1) / img.fanout;
+            const char *parentPath = dirs[dir->parent].path;
+            char path[sizeof(dir->path)];
+            if (snprintf(path, sizeof(path), "%s%sD%07u", parentPath, parentPath[0] ? "/" : "", d) >= (int)sizeof(path)) {
+                fprintf(stderr, "Directory tree too deep; raise the fan-out\n");
+                return 1;
+            }
+            memcpy(dir->path, path, sizeof(path));
+        }
+
+        uint64_t firstChild = (uint64_t)d * img.fanout + 1;
+        unsigned int numChildren = firstChild >= numDirs ? 0 :
+                                   (numDirs - firstChild < img.fanout ? numDirs - firstChild : img.fanout);
+        unsigned int firstFile = d * img.fanout;
+        unsigned int numFiles = img.numFiles - firstFile < img.fanout ? img.numFiles - firstFile : img.fanout;
+
+        // "." and "..", or BIG.BIN and PERM.BIN in the root, then the 0x00 end marker
+        unsigned int numEntries = 2 + numChildren + numFiles + 1;
+        unsigned int numClusters = (numEntries + entriesPerCluster - 1) / entriesPerCluster;
+        unsigned int *clusters = malloc(numClusters * sizeof(unsigned int));
+        // a subdirectory's first cluster was taken when its parent's entry was written
+        clusters[0] = d == 0 ? 2 : dir->firstCluster;
+        unsigned int rest = numClusters > 1 ? allocClusters(&img, numClusters - 1) : 0;
+        for (unsigned int c = 1; c < numClusters; c++) clusters[c] = rest + c - 1;
+        linkChain(&img, clusters, numClusters);
+
+        DirEntry *entries = calloc(numClusters, img.clusterSize);
+        if (d == 0) {
+            placeRootFiles(&img, entries);
+        } else {
+            setEntry(&entries[0], ".", 0x10, dir->firstCluster, 0);
+            setEntry(&entries[1], "..", 0x10, dir->parent == 0 ? 0 : dirs[dir->parent].firstCluster, 0);
+        }
+        for (unsigned int i = 0; i < numChildren; i++) {
+            BenchDir *child = &dirs[firstChild + i];
+            char name[13];
+            snprintf(name, sizeof(name), "D%07u", (unsigned int)(firstChild + i));
+            child->firstCluster = allocClusters(&img, 1);
+            setEntry(&entries[2 + i], name, 0x10, child->firstCluster, 0);
+            sum.entries++;
+        }
+        for (unsigned int i = 0; i < numFiles; i++) {
+            placeFile(&img, dir, firstFile + i, &entries[2 + numChildren + i], manifest, &sum);
+        }
+
+        for (unsigned int c = 0; c < numClusters; c++) {
+            writeAt(&img, (char *)entries + (uint64_t)c * img.clusterSize, img.clusterSize,
+                    clusterOffset(&img, clusters[c]));
+        }
+        free(entries);
+        free(clusters);
+    }
+
+    writeBootSector(&img);
+    writeFats(&img);
+    fclose(manifest);
+    close(img.fd);
+
+    printf("cluster_size %u\n", img.clusterSize);
+    printf("clusters_used %u\n", img.nextCluster - 2);
+    printf("directories %u\n", numDirs);
+    printf("entries %u\n", sum.entries);
+    printf("deleted %u\n", sum.deleted);
+    printf("deleted_bytes %llu\n", (unsigned long long)sum.deletedBytes);
+    printf("fragmented %u\n", sum.fragmented);
+    printf("live_bytes %llu\n", (unsigned long long)sum.liveBytes);
+    printf("manifest %s\n", manifestPath);
+    free(dirs);
+    free(img.fat);
+    return 0;
+}
@@ -0,0 +1,678 @@
+/**
+ * FAT32 Test Image Generator
+ *
+ * Builds sparse FAT32 disk images for exercising fatrec32 on volumes far
+ * larger than the sample disks, up to the 2 TB limit of FAT32. Only the boot
+ * sector, the FAT pages that hold non-zero entries, the root directory and
+ * the file clusters are written; everything else is left as a hole, so a
+ * 2 TB image costs a few megabytes of real disk space.
+ *
+ * Every file gets deterministic pseudo-random contents and its SHA-1 is
+ * printed as "NAME sha1" so tests can pass it to -r/-R -s.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+
+#define CLUSTER_EOC 0x0FFFFFFF   // end-of-chain marker written for live files
+#define MAX_CLUSTERS 0x0FFFFFF5  // largest cluster count of a FAT32 volume
+#define RESERVED_SECTORS 32
+
+#pragma pack(push, 1)
+typedef struct BootEntry
+{
+  unsigned char BS_jmpBoot[3];
+  unsigned char BS_OEMName[8];
+  unsigned short BPB_BytsPerSec;
+  unsigned char BPB_SecPerClus;
+  unsigned short BPB_RsvdSecCnt;
+  unsigned char BPB_NumFATs;
+  unsigned short BPB_RootEntCnt;
+  unsigned short BPB_TotSec16;
+  unsigned char BPB_Media;
+  unsigned short BPB_FATSz16;
+  unsigned short BPB_SecPerTrk;
+  unsigned short BPB_NumHeads;
+  unsigned int BPB_HiddSec;
+  unsigned int BPB_TotSec32;
+  unsigned int BPB_FATSz32;
+  unsigned short BPB_ExtFlags;
+  unsigned short BPB_FSVer;
+  unsigned int BPB_RootClus;
+  unsigned short BPB_FSInfo;
+  unsigned short BPB_BkBootSec;
+  unsigned char BPB_Reserved[12];
+  unsigned char BS_DrvNum;
+  unsigned char BS_Reserved1;
+  unsigned char BS_BootSig;
+  unsigned int BS_VolID;
+  unsigned char BS_VolLab[11];
+  unsigned char BS_FilSysType[8];
+} BootEntry;
+
+typedef struct DirEntry
+{
+  unsigned char DIR_Name[11];
+  unsigned char DIR_Attr;
+  unsigned char DIR_NTRes;
+  unsigned char DIR_CrtTimeTenth;
+  unsigned short DIR_CrtTime;
+  unsigned short DIR_CrtDate;
+  unsigned short DIR_LstAccDate;
+  unsigned short DIR_FstClusHI;
+  unsigned short DIR_WrtTime;
+  unsigned short DIR_WrtDate;
+  unsigned short DIR_FstClusLO;
+  unsigned int DIR_FileSize;
+} DirEntry;
+#pragma pack(pop)
+
+#define LONG_NAME_UNITS 260     // 20 VFAT slots; more than the 255 VFAT allows, to test decoders
+
+/**
+ * A file to place on the image, parsed from a command-line spec.
+ */
+typedef struct FileSpec {
+    char path[128];             // DIR/NAME.EXT as given on the command line, without a trailing '/'
+    char name[13];              // 8.3 name, the last component of path
+    int isDir;                  // 1 for a one-cluster directory ("DIR/")
+    int attr;                   // DIR_Attr given with '#', -1 for 0x10 or 0x20
+    int parent;                 // spec of the directory holding it, -1 for the root
+    unsigned short longName[LONG_NAME_UNITS]; // long name stored in VFAT slots before the entry
+    unsigned int longLen;       // UTF-16 units in longName, 0 for none
+    int deleted;                // 1 if the entry is marked 0xE5 and its chain freed
+    int lost;                   // 1 if only the contents are written, with no entry at all
+    unsigned int size;          // file size in bytes
+    unsigned int *clusters;     // clusters in file order
+    unsigned int numClusters;
+} FileSpec;
+
+/**
+ * Geometry of the image being generated.
+ */
+typedef struct Image {
+    int fd;
+    unsigned int bytesPerSec;
+    unsigned int secPerClus;
+    unsigned int numFats;
+    int activeFat;              // -a: only FAT copy in use with mirroring off, -1 if mirrored
+    unsigned int totalSectors;
+    unsigned int fatSectors;
+    unsigned int clusterSize;
+    unsigned int clusterCount;
+    uint64_t dataStart;
+    unsigned int *fat;          // in-memory FAT, written back page by page
+} Image;
+
+/**
+ * Prints usage information to stderr.
+ */
+void errUse() {
+    fprintf(stderr, "Usage: mkfat32 [-b bytes-per-sector] [-c sectors-per-cluster] [-f fats] [-a active-fat]\n");
+    fprintf(stderr, "               image size [file...]\n");
+    fprintf(stderr, "  active-fat  Turn FAT mirroring off and keep the files' chains in this copy only;\n");
+    fprintf(stderr, "              the other copies only hold the root directory.\n");
+    fprintf(stderr, "  size        Volume size, with optional K, M, G or T suffix (e.g. 2047G).\n");
+    fprintf(stderr, "  file        [~|!]NAME.EXT[=long name]:size@clusters, '~' marks the entry deleted,\n");
+    fprintf(stderr, "              '!' writes the contents without an entry (overwritten).\n");
+    fprintf(stderr, "              DIR/:0@cluster is a one-cluster directory; DIR/NAME.EXT puts a file\n");
+    fprintf(stderr, "              in a directory given earlier. '#attr' sets DIR_Attr in hex (e.g. DIR/#12).\n");
+    fprintf(stderr, "              A long name (UTF-8, up to 260 UTF-16 units) is written as VFAT\n");
+    fprintf(stderr, "              slots before the entry.\n");
+    fprintf(stderr, "              clusters is a comma list of 'start' or 'start+count' runs;\n");
+    fprintf(stderr, "              'end' names the last cluster of the volume (e.g. end-3).\n");
+}
+
+/**
+ * Parses a byte count with an optional K/M/G/T binary suffix.
+ *
+ * @return The size in bytes, or 0 if the string is not a valid size
+ */
+uint64_t parseSize(const char *text) {
+    char *end;
+    uint64_t value = strtoull(text, &end, 10);
+
+    switch (toupper((unsigned char)*end)) {
+    case 'T': value <<= 10; // fall through
+    case 'G': value <<= 10; // fall through
+    case 'M': value <<= 10; // fall through
+    case 'K': value <<= 10; end++; break;
+    case '\0': break;
+    default: return 0;
+    }
+    return *end == '\0' ? value : 0;
+}
+
+/**
+ * Parses a cluster number, accepting "end" and "end-N" relative to the last
+ * cluster of the volume.
+ *
+ * @return The cluster number, or 0 if the text is not valid
+ */
+unsigned int parseCluster(Image *img, const char *text, char **rest) {
+    if (strncmp(text, "end", 3) == 0) {
+        unsigned int last = img->clusterCount + 1;
+        unsigned long back = 0;
+        *rest = (char *)text + 3;
+        if (**rest == '-') {
+            back = strtoul(*rest + 1, rest, 10);
+        }
+        return back < last - 1 ? last - back : 0;
+    }
+    return strtoul(text, rest, 10);
+}
+
+/**
+ * Decodes a UTF-8 long name into spec's UTF-16 units; characters outside the
+ * BMP become surrogate pairs.
+ *
+ * @return 1 on success, 0 if the name is not valid UTF-8 or too long
+ */
+int parseLongName(FileSpec *spec, const unsigned char *text, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        unsigned int code = text[i];
+        int extra = code < 0x80 ? 0 : code >= 0xF0 ? 3 : code >= 0xE0 ? 2 : code >= 0xC0 ? 1 : -1;
+        if (extra < 0 || i + extra >= len) return 0;
+        if (extra > 0) code &= 0x3F >> extra;
+        for (int k = 1; k <= extra; k++) {
+            if ((text[i + k] & 0xC0) != 0x80) return 0;
+            code = code << 6 | (text[i + k] & 0x3F);
+        }
+        i += 1 + extra;
+
+        int units = code >= 0x10000 ? 2 : 1;
+        if (code > 0x10FFFF || spec->longLen + units > LONG_NAME_UNITS) return 0;
+        if (units == 2) {
+            spec->longName[spec->longLen++] = 0xD800 + ((code - 0x10000) >> 10);
+            spec->longName[spec->longLen++] = 0xDC00 + ((code - 0x10000) & 0x3FF);
+        } else {
+            spec->longName[spec->longLen++] = code;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Parses "[~|!]NAME.EXT[#attr][=long name]:size@runs" into spec.
+ *
+ * @return 1 on success, 0 if the spec is malformed or out of range
+ */
+int parseFileSpec(Image *img, const char *text, FileSpec *spec) {
+    memset(spec, 0, sizeof(*spec));
+    if (*text == '~') {
+        spec->deleted = 1;
+        text++;
+    } else if (*text == '!') {
+        spec->deleted = 1;
+        spec->lost = 1;
+        text++;
+    }
+
+    const char *colon = strchr(text, ':');
+    const char *at = strchr(text, '@');
+    if (!colon || !at || at < colon || colon == text) return 0;
+
+    const char *equals = memchr(text, '=', colon - text);
+    const char *nameEnd = equals ? equals : colon;
+    const char *hash = memchr(text, '#', nameEnd - text);
+    spec->attr = -1;
+    if (hash) {
+        char *attrEnd;
+        spec->attr = strtoul(hash + 1, &attrEnd, 16);
+        if (attrEnd != nameEnd || attrEnd == hash + 1 || spec->attr > 0xFF) return 0;
+        nameEnd = hash;
+    }
+    if (nameEnd > text && nameEnd[-1] == '/') {
+        if (spec->lost) return 0;
+        spec->isDir = 1;
+        nameEnd--;
+    }
+    if ((size_t)(nameEnd - text) >= sizeof(spec->path) || nameEnd == text) return 0;
+    memcpy(spec->path, text, nameEnd - text);
+    const char *slash = strrchr(spec->path, '/');
+    const char *base = slash ? slash + 1 : spec->path;
+    if (strlen(base) > 12 || *base == '\0') return 0;
+    strcpy(spec->name, base);
+    if (equals) {
+        if (colon == equals + 1) return 0;
+        if (!parseLongName(spec, (const unsigned char *)equals + 1, colon - equals - 1)) return 0;
+    }
+
+    char *rest;
+    spec->size = strtoul(colon + 1, &rest, 10);
+    if (rest != at) return 0;
+
+    unsigned int needed = spec->size == 0 ? 1 : (spec->size - 1) / img->clusterSize + 1;
+    spec->clusters = malloc(needed * sizeof(unsigned int));
+    if (!spec->clusters) return 0;
+
+    const char *cur = at + 1;
+    while (*cur != '\0' && spec->numClusters < needed) {
+        unsigned int start = parseCluster(img, cur, &rest);
+        unsigned int count = 1;
+        if (*rest == '+') {
+            count = strtoul(rest + 1, &rest, 10);
+        }
+        if (start < 3 || count == 0) return 0;   // cluster 2 holds the root directory
+        for (unsigned int i = 0; i < count && spec->numClusters < needed; i++) {
+            if (start + i > img->clusterCount + 1) return 0;
+            spec->clusters[spec->numClusters++] = start + i;
+        }
+        if (*rest == ',') rest++;
+        else if (*rest != '\0') return 0;
+        cur = rest;
+    }
+
+    // a short run list continues contiguously from the last given cluster
+    while (spec->numClusters < needed) {
+        unsigned int next = spec->clusters[spec->numClusters - 1] + 1;
+        if (next > img->clusterCount + 1) return 0;
+        spec->clusters[spec->numClusters++] = next;
+    }
+    return 1;
+}
+
+/**
+ * Finds the directory holding specs[i] among the specs before it.
+ *
+ * @return 1 with specs[i].parent set, 0 if its directory wasn't given first
+ */
+int resolveParent(FileSpec *specs, int i) {
+    const char *slash = strrchr(specs[i].path, '/');
+    specs[i].parent = -1;
+    if (!slash) return 1;
+
+    size_t len = slash - specs[i].path;
+    for (int j = 0; j < i; j++) {
+        if (specs[j].isDir && strlen(specs[j].path) == len && strncmp(specs[j].path, specs[i].path, len) == 0) {
+            specs[i].parent = j;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fills a directory's "." and ".." entries.
+ */
+void writeDotEntries(DirEntry *table, unsigned int self, unsigned int parent) {
+    memcpy(table[0].DIR_Name, ".          ", 11);
+    memcpy(table[1].DIR_Name, "..         ", 11);
+    for (int i = 0; i < 2; i++) {
+        unsigned int cluster = i == 0 ? self : parent;
+        table[i].DIR_Attr = 0x10;
+        table[i].DIR_FstClusHI = cluster >> 16;
+        table[i].DIR_FstClusLO = cluster & 0xFFFF;
+    }
+}
+
+/**
+ * Converts "NAME.EXT" into the 11-byte space padded directory form.
+ */
+void toShortName(const char *name, unsigned char *out) {
+    memset(out, ' ', 11);
+    const char *dot = strchr(name, '.');
+    size_t baseLen = dot ? (size_t)(dot - name) : strlen(name);
+
+    for (size_t i = 0; i < baseLen && i < 8; i++) {
+        out[i] = toupper((unsigned char)name[i]);
+    }
+    if (dot) {
+        for (size_t i = 0; dot[1 + i] != '\0' && i < 3; i++) {
+            out[8 + i] = toupper((unsigned char)dot[1 + i]);
+        }
+    }
+}
+
+/**
+ * Number of VFAT slots holding a long name (13 characters each).
+ */
+int longNameSlots(const FileSpec *spec) {
+    return (spec->longLen + 12) / 13;
+}
+
+/**
+ * Writes the VFAT slots of spec's long name into slots, in on-disk order
+ * (last part first). A name filling all 20 slots has no terminator.
+ *
+ * @param spec  File with a long name
+ * @param name  Its 11-byte short name, for the checksum
+ * @param slots longNameSlots() entries to fill
+ */
+void writeLongName(FileSpec *spec, const unsigned char *name, DirEntry *slots) {
+    static const int unitOffsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    size_t len = spec->longLen;
+    int numSlots = longNameSlots(spec);
+
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    }
+
+    for (int part = 1; part <= numSlots; part++) {
+        unsigned char *slot = (unsigned char *)&slots[numSlots - part];
+        memset(slot, 0, sizeof(DirEntry));
+        slot[0] = part | (part == numSlots ? 0x40 : 0);
+        slot[11] = 0x0F;
+        slot[13] = sum;
+
+        for (int u = 0; u < 13; u++) {
+            size_t at = (size_t)(part - 1) * 13 + u;
+            unsigned short unit = at < len ? spec->longName[at] : at == len ? 0x0000 : 0xFFFF;
+            slot[unitOffsets[u]] = unit & 0xFF;
+            slot[unitOffsets[u] + 1] = unit >> 8;
+        }
+        if (spec->deleted) slot[0] = 0xE5;
+    }
+}
+
+/**
+ * Fills buffer with the deterministic contents of a file (xorshift seeded by
+ * the file name, so the same spec always produces the same SHA-1).
+ */
+void fillContents(const char *name, unsigned char *buffer, size_t len) {
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (const char *p = name; *p; p++) {
+        state = (state ^ (unsigned char)*p) * 0x100000001B3ull;
+    }
+    for (size_t i = 0; i < len; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        buffer[i] = 0x20 + (state % 95);
+    }
+}
+
+/**
+ * Gives a file named after a type fatrec32 knows (.PNG, .JPG, .PDF, .ZIP,
+ * .GIF) that type's header and trailer, so signature checks and carving can
+ * be tested. fillContents() only produces printable bytes, which can't form
+ * a binary trailer by chance.
+ */
+void addSignature(const char *name, unsigned char *buffer, size_t len) {
+    static const struct {
+        const char *ext;
+        const char *header;
+        size_t headerLen;
+        const char *trailer;       // last bytes of the file
+        size_t trailerLen;
+    } types[] = {
+        { ".PNG", "\x89PNG\r\n\x1A\n", 8, "IEND\xAE\x42\x60\x82", 8 },
+        { ".JPG", "\xFF\xD8\xFF\xE0", 4, "\xFF\xD9", 2 },
+        { ".PDF", "%PDF-1.4\n", 9, "%%EOF", 5 },
+        { ".ZIP", "PK\x03\x04", 4, "PK\x05\x06\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 22 },
+        { ".GIF", "GIF89a", 6, "\x00\x3B", 2 },
+    };
+
+    const char *dot = strrchr(name, '.');
+    for (size_t i = 0; dot != NULL && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(dot, types[i].ext) == 0 && len >= types[i].headerLen + types[i].trailerLen) {
+            memcpy(buffer, types[i].header, types[i].headerLen);
+            memcpy(buffer + len - types[i].trailerLen, types[i].trailer, types[i].trailerLen);
+        }
+    }
+}
+
+/**
+ * Writes len bytes at offset, exiting on failure.
+ */
+void writeAt(Image *img, const void *buffer, size_t len, uint64_t offset) {
+    if (pwrite(img->fd, buffer, len, offset) != (ssize_t)len) {
+        perror("pwrite");
+        exit(1);
+    }
+}
+
+/**
+ * Returns the byte offset of a data cluster.
+ */
+uint64_t clusterOffset(Image *img, unsigned int cluster) {
+    return img->dataStart + (uint64_t)(cluster - 2) * img->clusterSize;
+}
+
+/**
+ * Computes FAT size and cluster count for the requested volume size.
+ *
+ * @return 1 on success, 0 if the geometry is not a valid FAT32 volume
+ */
+int layoutImage(Image *img, uint64_t volumeSize) {
+    uint64_t sectors = volumeSize / img->bytesPerSec;
+    if (sectors > 0xFFFFFFFFull) {
+        fprintf(stderr, "Volume too large for a 32-bit sector count\n");
+        return 0;
+    }
+    img->totalSectors = sectors;
+    img->clusterSize = img->bytesPerSec * img->secPerClus;
+
+    // the FAT must cover every cluster left after the FATs themselves; sizing
+    // it for all non-reserved sectors is a slight overestimate and always safe
+    uint64_t clusters = (sectors - RESERVED_SECTORS) / img->secPerClus;
+    img->fatSectors = ((clusters + 2) * 4 + img->bytesPerSec - 1) / img->bytesPerSec;
+
+    uint64_t dataSectors = sectors - RESERVED_SECTORS - (uint64_t)img->numFats * img->fatSectors;
+    if (sectors <= RESERVED_SECTORS + (uint64_t)img->numFats * img->fatSectors) return 0;
+
+    clusters = dataSectors / img->secPerClus;
+    if (clusters < 16 || clusters > MAX_CLUSTERS) return 0;
+    img->clusterCount = clusters;
+    img->dataStart = (uint64_t)(RESERVED_SECTORS + img->numFats * img->fatSectors) * img->bytesPerSec;
+    return 1;
+}
+
+/**
+ * Writes the boot sector (and its backup at sector 6).
+ */
+void writeBootSector(Image *img) {
+    unsigned char *sector = calloc(1, img->bytesPerSec);
+    BootEntry *boot = (BootEntry *)sector;
+
+    memcpy(boot->BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(boot->BS_OEMName, "MKFAT32 ", 8);
+    boot->BPB_BytsPerSec = img->bytesPerSec;
+    boot->BPB_SecPerClus = img->secPerClus;
+    boot->BPB_RsvdSecCnt = RESERVED_SECTORS;
+    boot->BPB_NumFATs = img->numFats;
+    boot->BPB_Media = 0xF8;
+    boot->BPB_SecPerTrk = 63;
+    boot->BPB_NumHeads = 255;
+    boot->BPB_TotSec32 = img->totalSectors;
+    boot->BPB_FATSz32 = img->fatSectors;
+    boot->BPB_ExtFlags = img->activeFat >= 0 ? 0x80 | img->activeFat : 0;
+    boot->BPB_RootClus = 2;
+    boot->BPB_FSInfo = 1;
+    boot->BPB_BkBootSec = 6;
+    boot->BS_DrvNum = 0x80;
+    boot->BS_BootSig = 0x29;
+    boot->BS_VolID = 0x46415452;
+    memcpy(boot->BS_VolLab, "NO NAME    ", 11);
+    memcpy(boot->BS_FilSysType, "FAT32   ", 8);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    writeAt(img, sector, img->bytesPerSec, 0);
+    writeAt(img, sector, img->bytesPerSec, 6ull * img->bytesPerSec);
+    free(sector);
+}
+
+/**
+ * Writes every FAT copy, skipping all-zero pages so they stay sparse. With
+ * mirroring off, the inactive copies get only the reserved entries and the
+ * root directory, so reading the wrong copy shows up as missing chains.
+ */
+void writeFats(Image *img) {
+    const size_t page = 4096;
+    uint64_t fatBytes = (uint64_t)img->fatSectors * img->bytesPerSec;
+    unsigned char *fat = (unsigned char *)img->fat;
+    unsigned char zero[4096] = {0};
+
+    for (unsigned int copy = 0; copy < img->numFats; copy++) {
+        uint64_t base = (uint64_t)(RESERVED_SECTORS + copy * img->fatSectors) * img->bytesPerSec;
+        if (img->activeFat >= 0 && copy != (unsigned int)img->activeFat) {
+            writeAt(img, img->fat, 3 * sizeof(unsigned int), base);
+            continue;
+        }
+        for (uint64_t off = 0; off < fatBytes; off += page) {
+            size_t len = fatBytes - off < page ? fatBytes - off : page;
+            if (memcmp(fat + off, zero, len) != 0) {
+                writeAt(img, fat + off, len, base + off);
+            }
+        }
+    }
+}
+
+/**
+ * Writes a file's contents into its clusters and returns its SHA-1.
+ */
+void writeFile(Image *img, FileSpec *spec, unsigned char *digest) {
+    unsigned char *contents = malloc(spec->size ? spec->size : 1);
+    fillContents(spec->name, contents, spec->size);
+    addSignature(spec->name, contents, spec->size);
+
+    unsigned int written = 0;
+    for (unsigned int i = 0; i < spec->numClusters && written < spec->size; i++) {
+        unsigned int len = spec->size - written < img->clusterSize ? spec->size - written : img->clusterSize;
+        writeAt(img, contents + written, len, clusterOffset(img, spec->clusters[i]));
+        written += len;
+    }
+
+    EVP_Digest(contents, spec->size, digest, NULL, EVP_sha1(), NULL);
+    free(contents);
+}
+
+int main(int argc, char *argv[]) {
+    Image img = { .bytesPerSec = 512, .secPerClus = 1, .numFats = 2, .activeFat = -1 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:f:a:")) != -1) {
+        switch (opt) {
+        case 'b': img.bytesPerSec = atoi(optarg); break;
+        case 'c': img.secPerClus = atoi(optarg); break;
+        case 'f': img.numFats = atoi(optarg); break;
+        case 'a': img.activeFat = atoi(optarg); break;
+        default: errUse(); return 1;
+        }
+    }
+    if (argc - optind < 2 || img.activeFat >= (int)img.numFats) {
+        errUse();
+        return 1;
+    }
+
+    uint64_t volumeSize = parseSize(argv[optind + 1]);
+    if (!layoutImage(&img, volumeSize)) {
+        fprintf(stderr, "Invalid FAT32 geometry for size %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    int numFiles = argc - optind - 2;
+    FileSpec *specs = calloc(numFiles ? numFiles : 1, sizeof(FileSpec));
+    for (int i = 0; i < numFiles; i++) {
+        if (!parseFileSpec(&img, argv[optind + 2 + i], &specs[i])) {
+            fprintf(stderr, "Invalid file spec: %s\n", argv[optind + 2 + i]);
+            return 1;
+        }
+    }
+
+    // entries of the root (tables[numFiles]) and of each directory, all one cluster long
+    DirEntry **tables = calloc(numFiles + 1, sizeof(DirEntry *));
+    unsigned int *numEntries = calloc(numFiles + 1, sizeof(unsigned int));
+    for (int i = 0; i <= numFiles; i++) {
+        if (i < numFiles && !specs[i].isDir) continue;
+        tables[i] = calloc(1, img.clusterSize);
+        numEntries[i] = i < numFiles ? 2 : 0;
+    }
+    for (int i = 0; i < numFiles; i++) {
+        if (!resolveParent(specs, i)) {
+            fprintf(stderr, "No directory given before %s\n", specs[i].path);
+            return 1;
+        }
+        int table = specs[i].parent >= 0 ? specs[i].parent : numFiles;
+        if (!specs[i].lost) numEntries[table] += 1 + longNameSlots(&specs[i]);
+        if (numEntries[table] >= img.clusterSize / sizeof(DirEntry)) {
+            fprintf(stderr, "Too many files for a one-cluster directory\n");
+            return 1;
+        }
+    }
+
+    img.fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img.fd < 0 || ftruncate(img.fd, (uint64_t)img.totalSectors * img.bytesPerSec) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    img.fat = calloc((uint64_t)img.fatSectors * img.bytesPerSec, 1);
+    if (!img.fat) {
+        fprintf(stderr, "Can't allocate FAT\n");
+        return 1;
+    }
+    img.fat[0] = 0x0FFFFFF8;
+    img.fat[1] = 0x0FFFFFFF;
+    img.fat[2] = CLUSTER_EOC;   // root directory
+
+    DirEntry lostEntry;
+    for (int i = 0; i <= numFiles; i++) {
+        numEntries[i] = i < numFiles ? 2 : 0;
+    }
+    for (int i = 0; i < numFiles; i++) {
+        FileSpec *spec = &specs[i];
+        int table = spec->parent >= 0 ? spec->parent : numFiles;
+        DirEntry *entry = spec->lost ? &lostEntry : &tables[table][numEntries[table]++];
+        unsigned char digest[20];
+
+        toShortName(spec->name, entry->DIR_Name);
+        if (spec->longLen > 0 && !spec->lost) {
+            writeLongName(spec, entry->DIR_Name, entry);
+            numEntries[table] += longNameSlots(spec);
+            entry = &tables[table][numEntries[table] - 1];
+            toShortName(spec->name, entry->DIR_Name);
+        }
+        entry->DIR_Attr = spec->attr >= 0 ? spec->attr : spec->isDir ? 0x10 : 0x20;
+        entry->DIR_CrtDate = entry->DIR_WrtDate = (45 << 9) | (1 << 5) | 1;  // 2025-01-01
+        entry->DIR_FileSize = spec->isDir ? 0 : spec->size;
+        if (spec->isDir) {
+            entry->DIR_FstClusHI = spec->clusters[0] >> 16;
+            entry->DIR_FstClusLO = spec->clusters[0] & 0xFFFF;
+            writeDotEntries(tables[i], spec->clusters[0], spec->parent >= 0 ? specs[spec->parent].clusters[0] : 0);
+        } else if (spec->size > 0) {
+            entry->DIR_FstClusHI = spec->clusters[0] >> 16;
+            entry->DIR_FstClusLO = spec->clusters[0] & 0xFFFF;
+            writeFile(&img, spec, digest);
+        } else {
+            EVP_Digest("", 0, digest, NULL, EVP_sha1(), NULL);
+        }
+
+        if (spec->deleted) {
+            entry->DIR_Name[0] = 0xE5;
+        } else if (spec->isDir) {
+            img.fat[spec->clusters[0]] = CLUSTER_EOC;
+        } else if (spec->size > 0) {
+            for (unsigned int c = 0; c + 1 < spec->numClusters; c++) {
+                img.fat[spec->clusters[c]] = spec->clusters[c + 1];
+            }
+            img.fat[spec->clusters[spec->numClusters - 1]] = CLUSTER_EOC;
+        }
+
+        if (spec->isDir) continue;
+        printf("%s ", spec->path);
+        for (int b = 0; b < 20; b++) printf("%02x", digest[b]);
+        printf("\n");
+    }
+
+    // directories last, so a file's contents can't hide the entries of one
+    // that shares its clusters
+    writeBootSector(&img);
+    writeFats(&img);
+    writeAt(&img, tables[numFiles], img.clusterSize, clusterOffset(&img, 2));
+    for (int i = 0; i < numFiles; i++) {
+        if (specs[i].isDir) writeAt(&img, tables[i], img.clusterSize, clusterOffset(&img, specs[i].clusters[0]));
+    }
+
+    close(img.fd);
+    return 0;
+}